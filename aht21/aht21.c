@@ -67,9 +67,19 @@ measurement is completed.
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/math64.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
 #include "aht21.h"
 
 #define DEVICE_NAME "aht21"
+#define DEVICE_NAME_FMT DEVICE_NAME "-%d-%02x"  // one misc device per sensor: aht21-<bus>-<addr>
 #define AHT21_I2C_ADDR 0x38
 
 // CMDs
@@ -82,11 +92,112 @@ measurement is completed.
 #define AHT21_HUMIDITY_MULTIPLIER 100
 #define AHT21_TEMPERATURE_MULTIPLIER 200
 #define AHT21_TEMPERATURE_OFFSET 50
+#define AHT21_MEASURE_TIME_MS 80  // datasheet 2.3
+#define AHT21_BUSY_RETRY_MS 10
+#define AHT21_BUSY_RETRIES 10
+#define AHT21_MIN_PERIOD_MS (AHT21_MEASURE_TIME_MS + AHT21_BUSY_RETRIES * AHT21_BUSY_RETRY_MS)
+#define AHT21_MAX_BUFFER_DEPTH 32
 
+/*
+Module parameters are the defaults for every sensor, the matching device tree properties override them per sensor
+(binding in sensaht21,aht21.yaml):
+    sample_period_ms    sensaht21,sample-period-ms
+    buffer_depth        sensaht21,buffer-depth
+    filter              sensaht21,filter
+    deadband            sensaht21,deadband
+    crc_mode            sensaht21,crc-mode
+    priority            sensaht21,priority
+*/
+static unsigned int sample_period_ms;
+module_param(sample_period_ms, uint, 0444);
+MODULE_PARM_DESC(sample_period_ms, "Sampling period on the shared clock in ms, 0 = measure on every read (default)");
+
+static unsigned int buffer_depth = 1;
+module_param(buffer_depth, uint, 0444);
+MODULE_PARM_DESC(buffer_depth, "Number of samples kept for the filter, 1-32 (default 1)");
+
+static char *filter = "none";
+module_param(filter, charp, 0444);
+MODULE_PARM_DESC(filter, "Filter over the buffered samples: none, average or median (default none)");
+
+static unsigned int deadband;
+module_param(deadband, uint, 0444);
+MODULE_PARM_DESC(deadband, "Minimum change in C or % before a new value is reported (default 0)");
+
+static char *crc_mode = "strict";
+module_param(crc_mode, charp, 0444);
+MODULE_PARM_DESC(crc_mode, "CRC handling: strict rejects bad samples, warn logs them, off skips the check (default strict)");
+
+static unsigned int priority;
+module_param(priority, uint, 0444);
+MODULE_PARM_DESC(priority, "Sensors with higher priority are measured first in each sampling slot (default 0)");
+
+static unsigned int sample_slack_ms = 20;
+module_param(sample_slack_ms, uint, 0644);
+MODULE_PARM_DESC(sample_slack_ms, "How late a sampling slot may fire so the kernel can coalesce it with other timers, "
+                 "takes effect from the next slot when changed at runtime");
+
+static struct dentry *aht21_debugfs;  // clock statistics and one directory per sensor
+
+enum aht21_filter {
+    AHT21_FILTER_NONE,
+    AHT21_FILTER_AVERAGE,
+    AHT21_FILTER_MEDIAN,
+};
+
+static const char * const aht21_filter_names[] = {
+    [AHT21_FILTER_NONE] = "none",
+    [AHT21_FILTER_AVERAGE] = "average",
+    [AHT21_FILTER_MEDIAN] = "median",
+};
+
+enum aht21_crc_mode {
+    AHT21_CRC_STRICT,
+    AHT21_CRC_WARN,
+    AHT21_CRC_OFF,
+};
+
+static const char * const aht21_crc_mode_names[] = {
+    [AHT21_CRC_STRICT] = "strict",
+    [AHT21_CRC_WARN] = "warn",
+    [AHT21_CRC_OFF] = "off",
+};
+
+struct aht21_config {
+    u32 period_ms;
+    u32 buffer_depth;
+    enum aht21_filter filter;
+    u32 deadband;
+    enum aht21_crc_mode crc_mode;
+    u32 priority;
+};
+
+struct aht21_sample {
+    int temperature;
+    int humidity;
+};
 
 struct aht21_data {
+    struct kref ref;              // held by the driver until remove and by every open file
     struct i2c_client *client;
     struct miscdevice miscdev;
+    bool removed;                 // sensor unbound, reads fail with -ENODEV
+    struct aht21_config config;
+    struct list_head clock_node;  // entry in aht21_clock.devices
+    bool clocked;                 // sampled by the shared clock instead of on read
+    bool pending;                 // triggered in this slot, waiting to be collected
+    ktime_t next_due;             // next multiple of the period at which the shared clock samples it
+    u32 effective_period_ms;      // configured period raised to AHT21_MIN_PERIOD_MS, 0 when not on the clock
+    struct dentry *debugfs;
+    struct mutex lock;            // protects the buffer and the sample_* fields
+    struct aht21_sample *samples;  // ring of the last config.buffer_depth raw samples
+    u32 sample_head;
+    u32 sample_count;
+    bool sample_valid;
+    int sample_ret;
+    int sample_temperature;
+    int sample_humidity;
+    wait_queue_head_t sample_wq;
 };
 
 static u8 aht21_crc8(u8 *data, int len) {
@@ -108,45 +219,47 @@ static u8 aht21_crc8(u8 *data, int len) {
 }
 
 
-static int aht21_read_raw_data(struct i2c_client *client, int *temperature, int *humidity) {
+static int aht21_trigger_measurement(struct i2c_client *client) {
     u8 measure_cmd[3] = {AHT21_CMD_MEASURE, 0x33, 0x00};
-    u8 data[7];
-    int ret, retry;
-    u32 humidity_raw, temperature_raw;
-    u8 crc;
+    int ret;
 
-    // Trigger measurement
     ret = i2c_master_send(client, measure_cmd, 3);
     if (ret < 0) {
         PDEBUG("Failed to trigger measurement: %d\n", ret);
         dev_err(&client->dev, "Failed to trigger measurement: %d\n", ret);
         return ret;
     }
+    return 0;
+}
 
-    msleep(100);  // min 75 ms
-
-    for(retry = 0; retry < 10; retry++) {
-        ret = i2c_master_recv(client, data, 7);
-        if (ret < 0) {
-            dev_err(&client->dev, "Failed to read measurement data: %d\n", ret);
-            return ret;
-        }
+/*
+Reads back a measurement started by aht21_trigger_measurement().
+Returns -EBUSY without logging if the sensor has not finished converting yet, so callers can decide when to poll again.
+*/
+static int aht21_fetch_measurement(struct i2c_client *client, enum aht21_crc_mode crc_mode,
+                                   int *temperature, int *humidity) {
+    u8 data[7];
+    int ret;
+    u32 humidity_raw, temperature_raw;
+    u8 crc;
 
-        if (!(data[0] & AHT21_STATUS_BUSY)) {
-            break;
-        }
-        dev_info(&client->dev, "Measurement in progress, retrying...\n");
-        PDEBUG("Measurement in progress, retrying...\n");
-        msleep(10);
+    ret = i2c_master_recv(client, data, 7);
+    if (ret < 0) {
+        dev_err(&client->dev, "Failed to read measurement data: %d\n", ret);
+        return ret;
     }
     if (data[0] & AHT21_STATUS_BUSY) {
-        dev_err(&client->dev, "Sensor still busy after retries\n");
         return -EBUSY;
     }
-    crc = aht21_crc8(data, 6);
-    if (crc != data[6]) {
-        dev_err(&client->dev, "CRC check failed: calculated 0x%02X, received 0x%02X\n", crc, data[6]);
-        return -EIO;
+    if (crc_mode != AHT21_CRC_OFF) {
+        crc = aht21_crc8(data, 6);
+        if (crc != data[6] && crc_mode == AHT21_CRC_STRICT) {
+            dev_err(&client->dev, "CRC check failed: calculated 0x%02X, received 0x%02X\n", crc, data[6]);
+            return -EIO;
+        }
+        if (crc != data[6]) {
+            dev_warn(&client->dev, "CRC check failed: calculated 0x%02X, received 0x%02X\n", crc, data[6]);
+        }
     }
 
     // get humidity bits from data[1] and shift all to the left
@@ -171,7 +284,343 @@ static int aht21_read_raw_data(struct i2c_client *client, int *temperature, int
 }
 
 
+static int aht21_read_raw_data(struct i2c_client *client, enum aht21_crc_mode crc_mode,
+                               int *temperature, int *humidity) {
+    int ret, retry;
+
+    // Trigger measurement
+    ret = aht21_trigger_measurement(client);
+    if (ret < 0) {
+        return ret;
+    }
+
+    msleep(100);  // min 75 ms
+
+    for(retry = 0; retry < AHT21_BUSY_RETRIES; retry++) {
+        ret = aht21_fetch_measurement(client, crc_mode, temperature, humidity);
+        if (ret != -EBUSY) {
+            return ret;
+        }
+        dev_info(&client->dev, "Measurement in progress, retrying...\n");
+        PDEBUG("Measurement in progress, retrying...\n");
+        msleep(AHT21_BUSY_RETRY_MS);
+    }
+    dev_err(&client->dev, "Sensor still busy after retries\n");
+    return -EBUSY;
+}
+
+
+static int aht21_median(int *values, u32 count) {
+    int value;
+    u32 i, j;
+
+    // insertion sort, the buffer is at most AHT21_MAX_BUFFER_DEPTH long
+    for (i = 1; i < count; i++) {
+        value = values[i];
+        for (j = i; j > 0 && values[j - 1] > value; j--) {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
+    }
+    return values[count / 2];
+}
+
+/*
+Pushes a new raw sample into the buffer, runs the configured filter over it and updates the reported value
+unless the change stays within the deadband. Must be called with aht21->lock held.
+*/
+static void aht21_process_sample(struct aht21_data *aht21, int temperature, int humidity) {
+    struct aht21_config *config = &aht21->config;
+    int temperatures[AHT21_MAX_BUFFER_DEPTH], humidities[AHT21_MAX_BUFFER_DEPTH];
+    int temperature_sum = 0, humidity_sum = 0;
+    u32 i;
+
+    aht21->samples[aht21->sample_head].temperature = temperature;
+    aht21->samples[aht21->sample_head].humidity = humidity;
+    aht21->sample_head = (aht21->sample_head + 1) % config->buffer_depth;
+    if (aht21->sample_count < config->buffer_depth) {
+        aht21->sample_count++;
+    }
+
+    switch (config->filter) {
+    case AHT21_FILTER_AVERAGE:
+        for (i = 0; i < aht21->sample_count; i++) {
+            temperature_sum += aht21->samples[i].temperature;
+            humidity_sum += aht21->samples[i].humidity;
+        }
+        temperature = temperature_sum / (int)aht21->sample_count;
+        humidity = humidity_sum / (int)aht21->sample_count;
+        break;
+    case AHT21_FILTER_MEDIAN:
+        for (i = 0; i < aht21->sample_count; i++) {
+            temperatures[i] = aht21->samples[i].temperature;
+            humidities[i] = aht21->samples[i].humidity;
+        }
+        temperature = aht21_median(temperatures, aht21->sample_count);
+        humidity = aht21_median(humidities, aht21->sample_count);
+        break;
+    case AHT21_FILTER_NONE:
+    default:
+        break;
+    }
+
+    // keep reporting the previous value while the change is within the deadband
+    if (aht21->sample_valid && !aht21->sample_ret &&
+        abs(temperature - aht21->sample_temperature) <= (int)config->deadband &&
+        abs(humidity - aht21->sample_humidity) <= (int)config->deadband) {
+        return;
+    }
+    aht21->sample_temperature = temperature;
+    aht21->sample_humidity = humidity;
+}
+
+
+/*
+Shared sampling clock.
+Instead of every sensor running its own timer and sleeping through its own conversion, all sensors are driven
+from one clock with two phases per slot:
+    TRIGGER: one wakeup sends the measure CMD to every sensor that is due
+    COLLECT: one wakeup AHT21_MEASURE_TIME_MS after the last trigger reads back those sensors; sensors that
+             are still busy are polled again together after AHT21_BUSY_RETRY_MS
+Every sensor keeps its own configured period: it is due at absolute multiples of that period on
+CLOCK_MONOTONIC, so it does not drift and does not depend on which other sensors are on the clock.
+A sensor may be sampled up to sample_slack_ms late, never early. The TRIGGER wakeup is placed as late in that
+window as possible, so that every sensor falling due within sample_slack_ms of the earliest one shares it,
+and the hrtimer slack lets the kernel merge it with other timers that expire nearby.
+Within a slot sensors are measured in order of priority.
+*/
+enum aht21_clock_phase {
+    AHT21_PHASE_TRIGGER,
+    AHT21_PHASE_COLLECT,
+};
+
+struct aht21_clock {
+    struct mutex ctl_lock;      // serialises starting and stopping the clock
+    struct mutex lock;          // protects everything below and clock_node, pending, next_due and
+                                // effective_period_ms of each device; taken before aht21->lock
+    struct list_head devices;
+    struct hrtimer timer;
+    struct work_struct work;
+    enum aht21_clock_phase phase;
+    int retries;
+    bool running;
+    // timer expiries by phase, exported read-only in debugfs
+    u64 trigger_runs;
+    u64 collect_runs;
+    u64 retry_runs;             // extra COLLECT runs for sensors that were still busy
+};
+
+static struct aht21_clock aht21_clock = {
+    .ctl_lock = __MUTEX_INITIALIZER(aht21_clock.ctl_lock),
+    .lock = __MUTEX_INITIALIZER(aht21_clock.lock),
+    .devices = LIST_HEAD_INIT(aht21_clock.devices),
+};
+
+static unsigned int aht21_period_ms(struct aht21_data *aht21) {
+    return max_t(unsigned int, aht21->config.period_ms, AHT21_MIN_PERIOD_MS);
+}
+
+static void aht21_clock_arm(struct aht21_clock *clock, ktime_t expires) {
+    hrtimer_start_range_ns(&clock->timer, expires, (u64)READ_ONCE(sample_slack_ms) * NSEC_PER_MSEC, HRTIMER_MODE_ABS);
+}
+
+/*
+Returns the first multiple of @period_ms on CLOCK_MONOTONIC after @after.
+*/
+static ktime_t aht21_next_boundary(ktime_t after, unsigned int period_ms) {
+    u64 period_ns = (u64)period_ms * NSEC_PER_MSEC;
+
+    return ns_to_ktime((div64_u64(ktime_to_ns(after), period_ns) + 1) * period_ns);
+}
+
+/*
+Arms the next TRIGGER wakeup. Must be called with clock->lock held and at least one sensor on the clock.
+The wakeup may fire anywhere between the latest due time within sample_slack_ms of the earliest one and the
+earliest one plus sample_slack_ms, so it samples all those sensors together and none of them early.
+*/
+static void aht21_clock_schedule(struct aht21_clock *clock) {
+    struct aht21_data *aht21;
+    ktime_t earliest = KTIME_MAX, latest, deadline;
+
+    list_for_each_entry(aht21, &clock->devices, clock_node) {
+        if (ktime_before(aht21->next_due, earliest)) {
+            earliest = aht21->next_due;
+        }
+    }
+    deadline = ktime_add_ms(earliest, READ_ONCE(sample_slack_ms));
+    latest = earliest;
+    list_for_each_entry(aht21, &clock->devices, clock_node) {
+        if (ktime_after(aht21->next_due, latest) && !ktime_after(aht21->next_due, deadline)) {
+            latest = aht21->next_due;
+        }
+    }
+    clock->phase = AHT21_PHASE_TRIGGER;
+    hrtimer_start_range_ns(&clock->timer, latest, ktime_to_ns(ktime_sub(deadline, latest)), HRTIMER_MODE_ABS);
+}
+
+static void aht21_publish_sample(struct aht21_data *aht21, int ret, int temperature, int humidity) {
+    mutex_lock(&aht21->lock);
+    if (!ret) {
+        aht21_process_sample(aht21, temperature, humidity);
+    }
+    aht21->sample_ret = ret;
+    WRITE_ONCE(aht21->sample_valid, true);
+    mutex_unlock(&aht21->lock);
+    wake_up_interruptible(&aht21->sample_wq);
+}
+
+static enum hrtimer_restart aht21_clock_timer_fn(struct hrtimer *timer) {
+    struct aht21_clock *clock = container_of(timer, struct aht21_clock, timer);
+
+    // I2C transfers sleep, so do the actual work in process context
+    queue_work(system_power_efficient_wq, &clock->work);
+    return HRTIMER_NORESTART;
+}
+
+static void aht21_clock_work_fn(struct work_struct *work) {
+    struct aht21_clock *clock = container_of(work, struct aht21_clock, work);
+    struct aht21_data *aht21;
+    int temperature = 0, humidity = 0;
+    bool busy = false, triggered = false;
+    ktime_t now;
+    int ret;
+
+    mutex_lock(&clock->lock);
+    if (!clock->running) {
+        mutex_unlock(&clock->lock);
+        return;
+    }
+    if (clock->phase == AHT21_PHASE_TRIGGER) {
+        clock->trigger_runs++;
+        now = ktime_get();
+        list_for_each_entry(aht21, &clock->devices, clock_node) {
+            aht21->pending = false;
+            if (ktime_after(aht21->next_due, now)) {
+                continue;
+            }
+            // skip samples we overslept instead of bursting to catch up
+            aht21->next_due = aht21_next_boundary(now, aht21->effective_period_ms);
+            ret = aht21_trigger_measurement(aht21->client);
+            aht21->pending = !ret;
+            triggered |= aht21->pending;
+            if (ret) {
+                aht21_publish_sample(aht21, ret, 0, 0);
+            }
+        }
+        if (!triggered) {
+            aht21_clock_schedule(clock);
+            mutex_unlock(&clock->lock);
+            return;
+        }
+        // time the conversion from when the triggers went out, not from the nominal slot start,
+        // which the timer slack and workqueue latency may have pushed us past
+        now = ktime_get();
+        clock->phase = AHT21_PHASE_COLLECT;
+        clock->retries = 0;
+        aht21_clock_arm(clock, ktime_add_ms(now, AHT21_MEASURE_TIME_MS));
+        mutex_unlock(&clock->lock);
+        return;
+    }
+
+    if (clock->retries) {
+        clock->retry_runs++;
+    } else {
+        clock->collect_runs++;
+    }
+    list_for_each_entry(aht21, &clock->devices, clock_node) {
+        if (!aht21->pending) {
+            continue;
+        }
+        ret = aht21_fetch_measurement(aht21->client, aht21->config.crc_mode, &temperature, &humidity);
+        if (ret == -EBUSY && clock->retries < AHT21_BUSY_RETRIES) {
+            busy = true;
+            continue;
+        }
+        if (ret == -EBUSY) {
+            dev_err(&aht21->client->dev, "Sensor still busy after retries\n");
+        }
+        aht21->pending = false;
+        aht21_publish_sample(aht21, ret, temperature, humidity);
+    }
+
+    if (busy) {
+        clock->retries++;
+        aht21_clock_arm(clock, ktime_add_ms(ktime_get(), AHT21_BUSY_RETRY_MS));
+    } else {
+        aht21_clock_schedule(clock);
+    }
+    mutex_unlock(&clock->lock);
+}
+
+/*
+Adds a sensor to the shared clock, starting the clock for the first one.
+The sensor is first sampled at the next multiple of its period, sharing a wakeup with any other sensor due
+within sample_slack_ms of it.
+*/
+static void aht21_clock_attach(struct aht21_data *aht21) {
+    struct aht21_clock *clock = &aht21_clock;
+    struct aht21_data *pos;
+
+    mutex_lock(&clock->ctl_lock);
+    mutex_lock(&clock->lock);
+    // keep the list sorted by descending priority, FIFO among equals
+    list_for_each_entry(pos, &clock->devices, clock_node) {
+        if (pos->config.priority < aht21->config.priority) {
+            break;
+        }
+    }
+    list_add_tail(&aht21->clock_node, &pos->clock_node);
+    aht21->effective_period_ms = aht21_period_ms(aht21);
+    aht21->next_due = aht21_next_boundary(ktime_get(), aht21->effective_period_ms);
+    if (!clock->running) {
+        hrtimer_init(&clock->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        clock->timer.function = aht21_clock_timer_fn;
+        INIT_WORK(&clock->work, aht21_clock_work_fn);
+        clock->running = true;
+        aht21_clock_schedule(clock);
+    } else if (clock->phase == AHT21_PHASE_TRIGGER) {
+        // the new sensor may be due before the wakeup that is already armed
+        aht21_clock_schedule(clock);
+    }
+    mutex_unlock(&clock->lock);
+    mutex_unlock(&clock->ctl_lock);
+}
+
+/*
+Removes a sensor from the shared clock, stopping the clock after the last one.
+*/
+static void aht21_clock_detach(struct aht21_data *aht21) {
+    struct aht21_clock *clock = &aht21_clock;
+    bool stop;
+
+    mutex_lock(&clock->ctl_lock);
+    mutex_lock(&clock->lock);
+    list_del_init(&aht21->clock_node);
+    stop = clock->running && list_empty(&clock->devices);
+    if (stop) {
+        clock->running = false;  // the work no longer re-arms the timer after this
+    }
+    mutex_unlock(&clock->lock);
+    if (stop) {
+        hrtimer_cancel(&clock->timer);
+        cancel_work_sync(&clock->work);
+    }
+    mutex_unlock(&clock->ctl_lock);
+}
+
+
+static void aht21_data_release(struct kref *ref) {
+    struct aht21_data *aht21 = container_of(ref, struct aht21_data, ref);
+
+    kfree(aht21->samples);
+    kfree(aht21);
+}
+
 static int aht21_open(struct inode *inode, struct file *file) {
+    // misc_open() holds misc_mtx here, so this cannot race with misc_deregister() in remove
+    struct aht21_data *aht21_data = container_of(file->private_data, struct aht21_data, miscdev);
+
+    kref_get(&aht21_data->ref);
     return 0;
 }
 
@@ -185,7 +634,31 @@ static ssize_t aht21_read(struct file *file, char __user *buf, size_t count, lof
     }
 
     struct aht21_data *aht21_data = container_of(file->private_data, struct aht21_data, miscdev);
-    ret = aht21_read_raw_data(aht21_data->client, &temperature, &humidity);
+    if (aht21_data->clocked) {
+        // return the latest sample from the shared clock, waiting for the first one if needed
+        ret = wait_event_interruptible(aht21_data->sample_wq,
+                                       READ_ONCE(aht21_data->sample_valid) || READ_ONCE(aht21_data->removed));
+        if (ret) {
+            return ret;
+        }
+    }
+    mutex_lock(&aht21_data->lock);
+    if (aht21_data->removed) {
+        mutex_unlock(&aht21_data->lock);
+        return -ENODEV;
+    }
+    if (!aht21_data->clocked) {
+        ret = aht21_read_raw_data(aht21_data->client, aht21_data->config.crc_mode, &temperature, &humidity);
+        if (!ret) {
+            aht21_process_sample(aht21_data, temperature, humidity);
+        }
+        aht21_data->sample_ret = ret;
+        aht21_data->sample_valid = true;
+    }
+    ret = aht21_data->sample_ret;
+    temperature = aht21_data->sample_temperature;
+    humidity = aht21_data->sample_humidity;
+    mutex_unlock(&aht21_data->lock);
     if (ret < 0) {
         return ret;
     }
@@ -201,6 +674,9 @@ static ssize_t aht21_read(struct file *file, char __user *buf, size_t count, lof
 }
 
 static int aht21_release(struct inode *inode, struct file *file) {
+    struct aht21_data *aht21_data = container_of(file->private_data, struct aht21_data, miscdev);
+
+    kref_put(&aht21_data->ref, aht21_data_release);
     return 0;
 }
 
@@ -230,12 +706,65 @@ static const struct file_operations aht21_fops = {
     .release = aht21_release,
 };
 
+/*
+Reads the sensor configuration, starting from the module parameters and applying any device tree overrides,
+so that every sensor starts sampling in its final configuration straight from probe.
+*/
+static int aht21_parse_config(struct i2c_client *client, struct aht21_config *config) {
+    struct device_node *np = client->dev.of_node;
+    const char *filter_name = filter;
+    const char *crc_mode_name = crc_mode;
+    int ret;
+
+    config->period_ms = sample_period_ms;
+    config->buffer_depth = buffer_depth;
+    config->deadband = deadband;
+    config->priority = priority;
+
+    // of_property_read_*() leave the value untouched when the property is missing
+    of_property_read_u32(np, "sensaht21,sample-period-ms", &config->period_ms);
+    of_property_read_u32(np, "sensaht21,buffer-depth", &config->buffer_depth);
+    of_property_read_u32(np, "sensaht21,deadband", &config->deadband);
+    of_property_read_u32(np, "sensaht21,priority", &config->priority);
+    of_property_read_string(np, "sensaht21,filter", &filter_name);
+    of_property_read_string(np, "sensaht21,crc-mode", &crc_mode_name);
+
+    if (config->buffer_depth < 1 || config->buffer_depth > AHT21_MAX_BUFFER_DEPTH) {
+        dev_err(&client->dev, "Invalid buffer depth %u, must be 1-%d\n", config->buffer_depth, AHT21_MAX_BUFFER_DEPTH);
+        return -EINVAL;
+    }
+    if (config->period_ms && config->period_ms < AHT21_MIN_PERIOD_MS) {
+        dev_warn(&client->dev, "Sampling period %u ms too short, using %d ms\n", config->period_ms, AHT21_MIN_PERIOD_MS);
+    }
+
+    ret = match_string(aht21_filter_names, ARRAY_SIZE(aht21_filter_names), filter_name);
+    if (ret < 0) {
+        dev_err(&client->dev, "Unknown filter \"%s\"\n", filter_name);
+        return -EINVAL;
+    }
+    config->filter = ret;
+
+    ret = match_string(aht21_crc_mode_names, ARRAY_SIZE(aht21_crc_mode_names), crc_mode_name);
+    if (ret < 0) {
+        dev_err(&client->dev, "Unknown CRC mode \"%s\"\n", crc_mode_name);
+        return -EINVAL;
+    }
+    config->crc_mode = ret;
+
+    dev_info(&client->dev, "period %u ms, buffer %u, filter %s, deadband %u, crc %s, priority %u\n",
+             config->period_ms, config->buffer_depth, aht21_filter_names[config->filter], config->deadband,
+             aht21_crc_mode_names[config->crc_mode], config->priority);
+    return 0;
+}
+
 /*
 Driver probe func.
-Check for I2C functionality, allocate memory for device data, register misc device, and set client data.
+Check for I2C functionality, allocate memory for device data, apply the configuration, register misc device,
+and set client data.
 */
 static int aht21_probe(struct i2c_client *client, const struct i2c_device_id *id) {
     struct aht21_data *aht21;
+    int ret;
     PDEBUG("AHT21 sensor probed successfully\n");
     if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C)) {
         PDEBUG("AHT21: I2C functionality not supported\n");
@@ -246,30 +775,73 @@ static int aht21_probe(struct i2c_client *client, const struct i2c_device_id *id
         PDEBUG("AHT21: Sensor initialization failed\n");
         return -EIO;
     }
-    aht21 = devm_kzalloc(&client->dev, sizeof(struct aht21_data), GFP_KERNEL);
+    // not devm: open files keep the data alive past remove through the kref
+    aht21 = kzalloc(sizeof(struct aht21_data), GFP_KERNEL);
     if (!aht21) {
         PDEBUG("AHT21: Failed to allocate memory\n");
         return -ENOMEM;
     }
+    kref_init(&aht21->ref);
+    if (aht21_parse_config(client, &aht21->config)) {
+        PDEBUG("AHT21: Invalid configuration\n");
+        ret = -EINVAL;
+        goto err_put;
+    }
+    aht21->samples = kcalloc(aht21->config.buffer_depth, sizeof(*aht21->samples), GFP_KERNEL);
+    if (!aht21->samples) {
+        PDEBUG("AHT21: Failed to allocate sample buffer\n");
+        ret = -ENOMEM;
+        goto err_put;
+    }
     aht21->client = client;
+    INIT_LIST_HEAD(&aht21->clock_node);
+    mutex_init(&aht21->lock);
+    init_waitqueue_head(&aht21->sample_wq);
+    aht21->clocked = aht21->config.period_ms != 0;
     aht21->miscdev.minor = MISC_DYNAMIC_MINOR;
-    aht21->miscdev.name = DEVICE_NAME;
+    aht21->miscdev.name = devm_kasprintf(&client->dev, GFP_KERNEL, DEVICE_NAME_FMT,
+                                         client->adapter->nr, client->addr);
+    if (!aht21->miscdev.name) {
+        PDEBUG("AHT21: Failed to allocate device name\n");
+        ret = -ENOMEM;
+        goto err_put;
+    }
     aht21->miscdev.fops = &aht21_fops;
     aht21->miscdev.parent = &client->dev;
     if (misc_register(&aht21->miscdev)) {
         PDEBUG("AHT21: Failed to register misc device\n");
-        return -EIO;
+        ret = -EIO;
+        goto err_put;
     }
     i2c_set_clientdata(client, aht21);
+    aht21->debugfs = debugfs_create_dir(aht21->miscdev.name, aht21_debugfs);
+    debugfs_create_u32("period_ms", 0444, aht21->debugfs, &aht21->effective_period_ms);
+    if (aht21->clocked) {
+        aht21_clock_attach(aht21);
+    }
     PDEBUG("AHT21 sensor initialized successfully\n");
     return 0;
+
+err_put:
+    kref_put(&aht21->ref, aht21_data_release);
+    return ret;
 }
 
 static int aht21_remove(struct i2c_client *client) {
     struct aht21_data *data = i2c_get_clientdata(client);
     if (data) {
-        devm_kfree(&client->dev, data);
+        // no new opens after this, and the clock no longer touches the sensor
         misc_deregister(&data->miscdev);
+        debugfs_remove_recursive(data->debugfs);
+        aht21_clock_detach(data);
+
+        // fail reads on files that are still open and wake readers waiting for a sample
+        mutex_lock(&data->lock);
+        WRITE_ONCE(data->removed, true);
+        mutex_unlock(&data->lock);
+        wake_up_interruptible_all(&data->sample_wq);
+
+        kref_put(&data->ref, aht21_data_release);
     }
     PDEBUG("AHT21 sensor removed\n");
     return 0;
@@ -297,7 +869,28 @@ static struct i2c_driver aht21_driver = {
     .id_table = aht21_id,
 };
 
-module_i2c_driver(aht21_driver);
+static int __init aht21_init(void) {
+    int ret;
+
+    aht21_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_u64("trigger_runs", 0444, aht21_debugfs, &aht21_clock.trigger_runs);
+    debugfs_create_u64("collect_runs", 0444, aht21_debugfs, &aht21_clock.collect_runs);
+    debugfs_create_u64("retry_runs", 0444, aht21_debugfs, &aht21_clock.retry_runs);
+
+    ret = i2c_add_driver(&aht21_driver);
+    if (ret) {
+        debugfs_remove_recursive(aht21_debugfs);
+    }
+    return ret;
+}
+
+static void __exit aht21_exit(void) {
+    i2c_del_driver(&aht21_driver);
+    debugfs_remove_recursive(aht21_debugfs);
+}
+
+module_init(aht21_init);
+module_exit(aht21_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Nikolay Chalkanov");
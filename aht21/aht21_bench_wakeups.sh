@@ -0,0 +1,107 @@
+#!/bin/bash
+
+# Script to measure CPU wakeups with the AHT21 shared sampling clock, with slack 0 against the configured slack
+# Usage: ./aht21_bench_wakeups.sh [seconds per run]
+# The sensors must be on the shared clock, through the sample_period_ms module parameter, e.g.
+# modprobe aht21 sample_period_ms=1000, or the sensaht21,sample-period-ms device tree property
+# Needs root, debugfs mounted and ideally tracefs with CONFIG_HIST_TRIGGERS for the idle exit count
+# Run it on an otherwise idle system, everything else that wakes the CPU is counted too
+
+MODULE_NAME="aht21"
+DURATION=${1:-60}
+PARAMS="/sys/module/${MODULE_NAME}/parameters"
+STATS="/sys/kernel/debug/${MODULE_NAME}"
+
+if [ ! -d "${PARAMS}" ]; then
+    echo "Error: ${MODULE_NAME} module is not loaded"
+    exit 1
+fi
+if [ ! -r "${STATS}/trigger_runs" ]; then
+    echo "Error: ${STATS} not readable, mount debugfs and run as root"
+    exit 1
+fi
+
+SLACK_MS=$(cat "${PARAMS}/sample_slack_ms")
+if [ "${SLACK_MS}" -eq 0 ]; then
+    echo "Error: sample_slack_ms is 0, nothing to compare against (e.g. echo 20 > ${PARAMS}/sample_slack_ms)"
+    exit 1
+fi
+# restore the configured slack however we exit
+trap 'echo "${SLACK_MS}" > "${PARAMS}/sample_slack_ms"' EXIT
+
+# each sensor has its own debugfs directory, aht21-<bus>-<addr>, with its period, 0 when not clocked
+echo "Sensors on the shared sampling clock:"
+SENSORS=0
+PER_SENSOR_MIN=0
+for SENSOR in "${STATS}"/${MODULE_NAME}-*; do
+    [ -r "${SENSOR}/period_ms" ] || continue
+    PERIOD_MS=$(cat "${SENSOR}/period_ms")
+    [ "${PERIOD_MS}" -gt 0 ] || continue
+    echo "  $(basename "${SENSOR}"): every ${PERIOD_MS} ms"
+    SENSORS=$((SENSORS + 1))
+    # 2 expiries (trigger and collect) per sample of this sensor
+    PER_SENSOR_MIN=$((PER_SENSOR_MIN + 2 * DURATION * 1000 / PERIOD_MS))
+done
+if [ "${SENSORS}" -eq 0 ]; then
+    echo "Error: no sensor is on the shared sampling clock"
+    exit 1
+fi
+
+# Idle exits, counted by a histogram trigger on power:cpu_idle (state 4294967295 is PWR_EVENT_EXIT)
+TRACEFS=/sys/kernel/tracing
+[ -d "${TRACEFS}/events" ] || TRACEFS=/sys/kernel/debug/tracing
+IDLE_EVENT="${TRACEFS}/events/power/cpu_idle"
+IDLE_HIST="hist:keys=common_cpu:vals=hitcount if state == 4294967295"
+if [ -w "${IDLE_EVENT}/trigger" ] && [ -r "${IDLE_EVENT}/hist" ]; then
+    HAVE_IDLE=1
+else
+    HAVE_IDLE=0
+    echo "Note: power:cpu_idle histogram not available, idle exits are not reported"
+fi
+
+# Local timer interrupts summed over all CPUs: LOC on x86, arch_timer on ARM
+timer_irqs() {
+    awk 'NR == 1 { ncpu = NF; next }
+         $NF ~ /arch_timer/ || $1 == "LOC:" { for (i = 2; i <= ncpu + 1; i++) sum += $i }
+         END { print sum + 0 }' /proc/interrupts
+}
+
+clock_runs() {
+    echo $(( $(cat "${STATS}/trigger_runs") + $(cat "${STATS}/collect_runs") + $(cat "${STATS}/retry_runs") ))
+}
+
+# measure <slack_ms>: prints "<slots> <clock expiries> <timer irqs> <idle exits>"
+measure() {
+    local triggers irqs runs exits=0
+
+    echo "$1" > "${PARAMS}/sample_slack_ms"
+    sleep 1  # let the slot armed with the previous slack expire
+
+    triggers=$(cat "${STATS}/trigger_runs")
+    runs=$(clock_runs)
+    irqs=$(timer_irqs)
+    [ "${HAVE_IDLE}" -eq 1 ] && echo "${IDLE_HIST}" > "${IDLE_EVENT}/trigger"
+    sleep "${DURATION}"
+    if [ "${HAVE_IDLE}" -eq 1 ]; then
+        exits=$(awk '/^ *Hits:/ { print $2 }' "${IDLE_EVENT}/hist")
+        echo "!${IDLE_HIST}" > "${IDLE_EVENT}/trigger"
+    fi
+    echo "$(( $(cat "${STATS}/trigger_runs") - triggers )) $(( $(clock_runs) - runs ))" \
+         "$(( $(timer_irqs) - irqs )) ${exits:-0}"
+}
+
+echo "Measuring ${SENSORS} sensor(s) for ${DURATION} s with slack 0 ms, then ${DURATION} s with slack ${SLACK_MS} ms..."
+read -r SLOTS_0 RUNS_0 IRQS_0 EXITS_0 <<< "$(measure 0)"
+read -r SLOTS_S RUNS_S IRQS_S EXITS_S <<< "$(measure "${SLACK_MS}")"
+
+echo "==============================="
+printf "%-36s %12s %12s\n" "Measured" "slack 0 ms" "slack ${SLACK_MS} ms"
+printf "%-36s %12s %12s\n" "Sampling slots (TRIGGER runs)" "${SLOTS_0}" "${SLOTS_S}"
+printf "%-36s %12s %12s\n" "Shared clock timer expiries" "${RUNS_0}" "${RUNS_S}"
+printf "%-36s %12s %12s\n" "Local timer interrupts, all CPUs" "${IRQS_0}" "${IRQS_S}"
+if [ "${HAVE_IDLE}" -eq 1 ]; then
+    printf "%-36s %12s %12s\n" "CPU idle exits (wakeups), all CPUs" "${EXITS_0}" "${EXITS_S}"
+fi
+# Not measured: this driver never had per-sensor timers, this is only the arithmetic minimum such a design would need
+echo "Computed, not measured: one timer per sensor would need at least ${PER_SENSOR_MIN} expiries per run"
+echo "  (2 per sample, each sensor at its own period listed above)"
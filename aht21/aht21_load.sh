@@ -52,11 +52,11 @@ if [ -d "/sys/bus/i2c/devices" ]; then
 fi
 
 echo ""
-echo "Device file:"
-if [ -e "/dev/${DEVICE_NAME}" ]; then
-    ls -la "/dev/${DEVICE_NAME}"
+echo "Device files (one per sensor, ${DEVICE_NAME}-<bus>-<addr>):"
+if ls /dev/${DEVICE_NAME}-* &> /dev/null; then
+    ls -la /dev/${DEVICE_NAME}-*
 else
-    echo "/dev/${DEVICE_NAME} not found (may need to be created manually)"
+    echo "/dev/${DEVICE_NAME}-* not found (may need to be created manually)"
 fi
 
 echo ""
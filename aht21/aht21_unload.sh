@@ -15,11 +15,13 @@ else
     exit 1
 fi
 
-# Remove the device file
-if [ -e "/dev/${DEVICE_NAME}" ]; then
-    echo "Removing /dev/${DEVICE_NAME}..."
-    rm -f "/dev/${DEVICE_NAME}"
-fi
+# Remove the device files, one per sensor
+for DEV in /dev/${DEVICE_NAME}-*; do
+    if [ -e "${DEV}" ]; then
+        echo "Removing ${DEV}..."
+        rm -f "${DEV}"
+    fi
+done
 
 # Verify the module is unloaded
 if ! lsmod | grep -q "${MODULE_NAME}"; then